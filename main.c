@@ -3,22 +3,65 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <hidapi.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/hidraw.h>
+#endif
 
 #include "commands.h"
 #include "keycodes.h"
 
 #define PACKET_SIZE 32
+#define MAX_PACKET_SIZE 256
 
 #define RAW_USAGE_PAGE 0xff60
 #define RAW_USAGE_ID 0x61
 
+#define READ_TIMEOUT_MS 500
+#define TRANSPORT_RETRIES 2
+
 #undef DEBUG
 
-uint8_t packet[PACKET_SIZE];
+// One extra byte for the report ID that hid_write() expects up front.
+uint8_t packet[MAX_PACKET_SIZE + 1];
+int packet_size = PACKET_SIZE;
+
+// Upper bounds, in seconds, of the transaction latency histogram buckets.
+const double latency_buckets[] = {0.001, 0.002, 0.005, 0.01, 0.025,
+                                  0.05,  0.1,   0.25,  0.5};
+#define LATENCY_BUCKET_COUNT                                                   \
+  (sizeof(latency_buckets) / sizeof(latency_buckets[0]))
+
+struct transport_stats {
+  uint64_t transactions;
+  uint64_t timeouts;
+  uint64_t retries;
+  uint64_t latency_counts[LATENCY_BUCKET_COUNT + 1];
+  double latency_sum;
+};
+
+// Where transact() records its statistics, if anywhere.
+struct transport_stats *stats = NULL;
 
 hid_device *flag_device = NULL;
+char *flag_device_id = NULL;
+char device_serial[64];
+char *flag_socket = NULL;
+// Connection to a daemon that owns the device, used instead of flag_device.
+int daemon_fd = -1;
 uint8_t flag_row = 0;
 uint8_t flag_column = 0;
 uint8_t flag_layer = 0;
@@ -31,46 +74,194 @@ uint8_t flag_layer_count = 0;
 uint8_t flag_column_count = 0;
 uint8_t flag_row_count = 0;
 unsigned short flag_keycode = 0;
+unsigned short flag_interval = 0;
+char *flag_output = NULL;
+char *flag_store = NULL;
 
 void dump_packet() {
 #ifdef DEBUG
   printf("__ __ __ __ __ __ __ __\n");
-  printf("%02x %02x %02x %02x %02x %02x %02x %02x\n", packet[0], packet[1],
-         packet[2], packet[3], packet[4], packet[5], packet[6], packet[7]);
-  printf("%02x %02x %02x %02x %02x %02x %02x %02x\n", packet[8], packet[9],
-         packet[10], packet[11], packet[12], packet[13], packet[14],
-         packet[15]);
-  printf("%02x %02x %02x %02x %02x %02x %02x %02x\n", packet[16], packet[17],
-         packet[18], packet[19], packet[20], packet[21], packet[22],
-         packet[23]);
-  printf("%02x %02x %02x %02x %02x %02x %02x %02x\n", packet[24], packet[25],
-         packet[26], packet[27], packet[28], packet[29], packet[30],
-         packet[31]);
+  for (int i = 0; i < packet_size; i++) {
+    printf((i % 8 == 7) ? "%02x\n" : "%02x ", packet[i]);
+  }
 #endif
 }
 
-void send(uint8_t *data, int len) {
+double monotonic_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void record_latency(double seconds) {
+  size_t bucket = 0;
+  while (bucket < LATENCY_BUCKET_COUNT && seconds > latency_buckets[bucket]) {
+    bucket++;
+  }
+  stats->latency_counts[bucket]++;
+  stats->latency_sum += seconds;
+}
+
+int read_full(int fd, uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int write_full(int fd, uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Daemon wire format. Requests are a length byte followed by that many
+// bytes of VIA command; a zero length asks for daemon statistics. Responses
+// are a status byte, a 16-bit big-endian length and the response report.
+// On connect the daemon sends its 16-bit packet size, then a length byte
+// and the device serial.
+#define DAEMON_OK 0
+#define DAEMON_ERROR 1
+#define DAEMON_HEADER_SIZE 3
+
+// Have the daemon perform the exchange, leaving its response in packet.
+int daemon_transact(uint8_t *data, int len) {
+  uint8_t request[MAX_PACKET_SIZE + 1];
+  request[0] = len;
+  memcpy(request + 1, data, len);
+  uint8_t header[DAEMON_HEADER_SIZE];
+  if (write_full(daemon_fd, request, len + 1) != 0 ||
+      read_full(daemon_fd, header, sizeof(header)) != 0) {
+    fprintf(stderr, "Lost connection to daemon\n");
+    return -1;
+  }
+  int response_len = header[1] << 8 | header[2];
+  if (response_len > MAX_PACKET_SIZE ||
+      read_full(daemon_fd, packet, response_len) != 0) {
+    fprintf(stderr, "Lost connection to daemon\n");
+    return -1;
+  }
+  if (header[0] != DAEMON_OK) {
+    fprintf(stderr, "Daemon request failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Requests that only read device state, and so are safe to resend or to
+// answer with another identical request's response.
+int is_read_request(uint8_t *request, int len) {
+  if (len < 1) {
+    return 0;
+  }
+  switch (request[0]) {
+  case id_get_protocol_version:
+  case id_get_keyboard_value:
+  case id_dynamic_keymap_get_keycode:
+  case id_lighting_get_value:
+  case id_dynamic_keymap_macro_get_count:
+  case id_dynamic_keymap_macro_get_buffer_size:
+  case id_dynamic_keymap_macro_get_buffer:
+  case id_dynamic_keymap_get_layer_count:
+  case id_dynamic_keymap_get_buffer:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// A report answers a request when it echoes the request's bytes, which VIA
+// firmware does for every command, or reports the command as unhandled.
+int is_response_to(uint8_t *data, int len) {
+  return packet[0] == id_unhandled || memcmp(packet, data, len) == 0;
+}
+
+// Perform one request/response exchange with the device. Reports that do not
+// answer the request, such as late responses to an earlier attempt, are
+// discarded. Read requests are resent if the response times out. Returns 0
+// on success, -1 on failure.
+int transact(uint8_t *data, int len) {
+  if (daemon_fd >= 0) {
+    return daemon_transact(data, len);
+  }
   if (flag_device == NULL) {
     fprintf(stderr, "--device flag required.\n");
     exit(EXIT_FAILURE);
   }
 
-  memset(packet, 0, PACKET_SIZE);
-  memcpy(packet + 1, data, len);
+  int retries = is_read_request(data, len) ? TRANSPORT_RETRIES : 0;
+  double start = monotonic_seconds();
+  for (int attempt = 0; attempt <= retries; attempt++) {
+    if (attempt > 0 && stats != NULL) {
+      stats->retries++;
+    }
 
-  dump_packet();
+    memset(packet, 0, packet_size + 1);
+    memcpy(packet + 1, data, len);
 
-  if (hid_write(flag_device, packet, PACKET_SIZE) != PACKET_SIZE) {
-    perror("Error writing request\n");
-    exit(EXIT_FAILURE);
+    dump_packet();
+
+    if (hid_write(flag_device, packet, packet_size + 1) != packet_size + 1) {
+      perror("Error writing request\n");
+      return -1;
+    }
+
+    int read;
+    do {
+      read =
+          hid_read_timeout(flag_device, packet, packet_size, READ_TIMEOUT_MS);
+      if (read > 0 && read != packet_size) {
+        perror("Error reading response\n");
+        return -1;
+      }
+    } while (read > 0 && !is_response_to(data, len));
+    if (read < 0) {
+      perror("Error reading response\n");
+      return -1;
+    }
+    if (read == 0) {
+      if (stats != NULL) {
+        stats->timeouts++;
+      }
+      continue;
+    }
+
+    dump_packet();
+
+    if (stats != NULL) {
+      stats->transactions++;
+      record_latency(monotonic_seconds() - start);
+    }
+    return 0;
   }
 
-  if (hid_read_timeout(flag_device, packet, PACKET_SIZE, 500) != PACKET_SIZE) {
-    perror("Error reading response\n");
+  fprintf(stderr, "Timed out waiting for response\n");
+  return -1;
+}
+
+void send_request(uint8_t *data, int len) {
+  if (transact(data, len) != 0) {
     exit(EXIT_FAILURE);
   }
+}
 
-  dump_packet();
+// Largest payload a get/set buffer request can carry in one report, after
+// the command, 16-bit offset and size bytes. Kept even so that keycodes
+// never straddle two requests.
+uint8_t buffer_chunk_size() {
+  int chunk = packet_size - 4;
+  return ((chunk > 255) ? 255 : chunk) & ~1;
 }
 
 char *key_name(uint8_t key) {
@@ -121,6 +312,8 @@ void help() {
          "  keycodes\n"
          "  version -d [vendor:product]\n"
          "  uptime -d [vendor:product]\n"
+         "  metrics [-d vendor:product] [-R rows -C cols] [-i interval]\n"
+         "     [-o file] [-D store]\n"
          "Keymap:\n"
          "  get_keycode -d [vendor:product] -l [layer] -r [row] -c [column]\n"
          "  set_keycode -d [vendor:product] -l [layer] -r [row] -c [column]\n"
@@ -136,6 +329,13 @@ void help() {
          "  set_rgb_colour -d [vendor:product] -h [hue] -S [saturation]\n"
          "  dump_keymap -d [vendor:product] -L [layers] -R [rows] -C [cols]\n"
          "  reset_keymap -d [vendor:product]\n"
+         "Store:\n"
+         "  backup -d [vendor:product] -R [rows] -C [cols] [-L layers]\n"
+         "     [-D store]\n"
+         "  status -d [vendor:product] [-D store]\n"
+         "Daemon:\n"
+         "  daemon -d [vendor:product] [-U socket]\n"
+         "  daemon_stats [-U socket]\n"
          "\nFlags:\n"
          "-d VENDOR:PRODUCT\n"
          "   Select a device to command. Use 'devices' to enumerate\n"
@@ -163,7 +363,18 @@ void help() {
          "-R [row count] (0-255, default 0)\n"
          "   Number of rows in keymap.\n"
          "-C [column count] (0-255, default 0)\n"
-         "   Number of columns in keymap.\n");
+         "   Number of columns in keymap.\n"
+         "-i [interval] (0-65535, default 0)\n"
+         "   Seconds between metrics collections. 0 collects once.\n"
+         "-o [file]\n"
+         "   Atomically replace file with metrics instead of printing.\n"
+         "-D [store] (default: ~/.via)\n"
+         "   Keymap store directory.\n"
+         "-U [socket]\n"
+         "   Send requests through the daemon listening on socket instead\n"
+         "   of opening the device. Only used when given. daemon and\n"
+         "   daemon_stats default to $XDG_RUNTIME_DIR/via.sock. Not\n"
+         "   supported by metrics.\n");
 }
 
 void devices() {
@@ -194,70 +405,72 @@ void keycodes() {
 }
 
 void version() {
-  send((uint8_t[]){id_get_protocol_version}, 1);
+  send_request((uint8_t[]){id_get_protocol_version}, 1);
   printf("Version: %u\n", packet[1] << 8 | packet[2]);
 }
 
 void uptime() {
-  send((uint8_t[]){id_get_keyboard_value, id_uptime}, 2);
+  send_request((uint8_t[]){id_get_keyboard_value, id_uptime}, 2);
   uint32_t uptime =
       packet[2] << 24 | packet[3] << 16 | packet[4] << 8 | packet[5];
   printf("Uptime: %u\n", uptime);
 }
 
 void get_rgb_brightness() {
-  send((uint8_t[]){id_lighting_get_value, id_qmk_rgblight_brightness}, 2);
+  send_request((uint8_t[]){id_lighting_get_value, id_qmk_rgblight_brightness},
+               2);
   printf("Brightness: %hhu\n", packet[2]);
 }
 
 void get_rgb_mode() {
-  send((uint8_t[]){id_lighting_get_value, id_qmk_rgblight_effect}, 2);
+  send_request((uint8_t[]){id_lighting_get_value, id_qmk_rgblight_effect}, 2);
   printf("Mode: %hhu\n", packet[2]);
 }
 
 void get_rgb_speed() {
-  send((uint8_t[]){id_lighting_get_value, id_qmk_rgblight_effect_speed}, 2);
+  send_request(
+      (uint8_t[]){id_lighting_get_value, id_qmk_rgblight_effect_speed}, 2);
   printf("Speed: %hhu\n", packet[2]);
 }
 
 void get_rgb_colour() {
-  send((uint8_t[]){id_lighting_get_value, id_qmk_rgblight_color}, 2);
+  send_request((uint8_t[]){id_lighting_get_value, id_qmk_rgblight_color}, 2);
   printf("Hue: %hhu\n", packet[2]);
   printf("Saturation: %hhu\n", packet[3]);
 }
 
 void set_rgb_brightness() {
-  send((uint8_t[]){id_lighting_set_value, id_qmk_rgblight_color,
-                   flag_brightness},
-       3);
+  send_request((uint8_t[]){id_lighting_set_value, id_qmk_rgblight_color,
+                           flag_brightness},
+               3);
   printf("Brightness: %hhu\n", packet[2]);
 }
 
 void set_rgb_mode() {
-  send((uint8_t[]){id_lighting_set_value, id_qmk_rgblight_effect, flag_mode},
-       3);
+  send_request(
+      (uint8_t[]){id_lighting_set_value, id_qmk_rgblight_effect, flag_mode}, 3);
   printf("Mode: %hhu\n", packet[2]);
 }
 
 void set_rgb_speed() {
-  send((uint8_t[]){id_lighting_set_value, id_qmk_rgblight_effect_speed,
-                   flag_speed},
-       3);
+  send_request((uint8_t[]){id_lighting_set_value, id_qmk_rgblight_effect_speed,
+                           flag_speed},
+               3);
   printf("Speed: %hhu\n", packet[2]);
 }
 
 void set_rgb_colour() {
-  send((uint8_t[]){id_lighting_set_value, id_qmk_rgblight_color, flag_hue,
-                   flag_saturation},
-       4);
+  send_request((uint8_t[]){id_lighting_set_value, id_qmk_rgblight_color,
+                           flag_hue, flag_saturation},
+               4);
   printf("Hue: %hhu\n", packet[2]);
   printf("Saturation: %hhu\n", packet[3]);
 }
 
 void get_keycode() {
-  send((uint8_t[]){id_dynamic_keymap_get_keycode, flag_layer, flag_row,
-                   flag_column},
-       4);
+  send_request((uint8_t[]){id_dynamic_keymap_get_keycode, flag_layer,
+                           flag_row, flag_column},
+               4);
   printf("Layer: %hhu Row: %hhu Column: %hhu\n", packet[1], packet[2],
          packet[3]);
   unsigned short keycode = packet[4] << 8 | packet[5];
@@ -265,59 +478,356 @@ void get_keycode() {
 }
 
 void set_keycode() {
-  send((uint8_t[]){id_dynamic_keymap_set_keycode, flag_layer, flag_row,
-                   flag_column, flag_keycode >> 8, flag_keycode & 0xff},
-       6);
+  send_request((uint8_t[]){id_dynamic_keymap_set_keycode, flag_layer,
+                           flag_row, flag_column, flag_keycode >> 8,
+                           flag_keycode & 0xff},
+               6);
   unsigned short keycode = packet[4] << 8 | packet[5];
   printf("Keycode: 0x%hx %s\n", keycode, keycode_name(keycode));
 }
 
+// Highest byte offset addressable by the 16-bit get_buffer request.
+#define BUFFER_WINDOW_SIZE 0x10000
+
+typedef void (*keymap_entry_fn)(uint32_t index, uint16_t keycode, void *ctx);
+
+uint8_t get_layer_count() {
+  send_request((uint8_t[]){id_dynamic_keymap_get_layer_count}, 1);
+  return packet[1];
+}
+
+// Stream every keycode of a layers x rows x columns keymap to fn, one chunk
+// at a time. Returns 0 on success, -1 if a transaction failed or the device
+// has fewer layers than asked for.
+int read_keymap(uint8_t layers, uint8_t rows, uint8_t columns,
+                keymap_entry_fn fn, void *ctx) {
+  uint32_t map_size = (uint32_t)layers * rows * columns * 2;
+
+  // Reading past the last layer would return whatever follows the dynamic
+  // keymap in EEPROM.
+  if (transact((uint8_t[]){id_dynamic_keymap_get_layer_count}, 1) != 0) {
+    return -1;
+  }
+  if (layers > packet[1]) {
+    fprintf(stderr, "Device only has %hhu layers.\n", packet[1]);
+    return -1;
+  }
+
+  // Fetch the part of the keymap that the buffer offset can address in bulk.
+  uint32_t window_end =
+      (map_size > BUFFER_WINDOW_SIZE) ? BUFFER_WINDOW_SIZE : map_size;
+  uint32_t offset = 0;
+  while (offset < window_end) {
+    uint32_t remaining = window_end - offset;
+    uint8_t fetch_size =
+        (remaining > buffer_chunk_size()) ? buffer_chunk_size() : remaining;
+    if (transact((uint8_t[]){id_dynamic_keymap_get_buffer, offset >> 8,
+                             offset & 0xff, fetch_size},
+                 4) != 0) {
+      return -1;
+    }
+    for (int i = 0; i < fetch_size; i += 2) {
+      fn((offset + i) / 2, (packet[4 + i] << 8) | packet[5 + i], ctx);
+    }
+    offset += fetch_size;
+  }
+
+  // Anything beyond the window has to be read one key at a time.
+  for (uint32_t index = window_end / 2; index < map_size / 2; index++) {
+    uint8_t column = index % columns;
+    uint8_t row = (index / columns) % rows;
+    uint8_t layer = index / (columns * rows);
+    if (transact((uint8_t[]){id_dynamic_keymap_get_keycode, layer, row, column},
+                 4) != 0) {
+      return -1;
+    }
+    fn(index, packet[4] << 8 | packet[5], ctx);
+  }
+  return 0;
+}
+
+// SHA-256, used as the content hash of raw keymap buffers.
+#define SHA256_HEX_SIZE 65
+
+struct sha256 {
+  uint32_t state[8];
+  uint8_t block[64];
+  uint64_t length;
+};
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(struct sha256 *sha) {
+  static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                      0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19};
+  memcpy(sha->state, initial, sizeof(initial));
+  sha->length = 0;
+}
+
+void sha256_block(struct sha256 *sha) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)sha->block[i * 4] << 24 | sha->block[i * 4 + 1] << 16 |
+           sha->block[i * 4 + 2] << 8 | sha->block[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t v[8];
+  memcpy(v, sha->state, sizeof(v));
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = ROTR(v[4], 6) ^ ROTR(v[4], 11) ^ ROTR(v[4], 25);
+    uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+    uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+    uint32_t s0 = ROTR(v[0], 2) ^ ROTR(v[0], 13) ^ ROTR(v[0], 22);
+    uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+    memmove(&v[1], &v[0], 7 * sizeof(v[0]));
+    v[4] += t1;
+    v[0] = t1 + s0 + maj;
+  }
+  for (int i = 0; i < 8; i++) {
+    sha->state[i] += v[i];
+  }
+}
+
+void sha256_update(struct sha256 *sha, uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    sha->block[sha->length++ % 64] = data[i];
+    if (sha->length % 64 == 0) {
+      sha256_block(sha);
+    }
+  }
+}
+
+void sha256_hex(struct sha256 *sha, char hex[SHA256_HEX_SIZE]) {
+  uint64_t bits = sha->length * 8;
+  uint8_t pad = 0x80;
+  sha256_update(sha, &pad, 1);
+  pad = 0;
+  while (sha->length % 64 != 56) {
+    sha256_update(sha, &pad, 1);
+  }
+  for (int i = 7; i >= 0; i--) {
+    uint8_t byte = bits >> (8 * i);
+    sha256_update(sha, &byte, 1);
+  }
+  for (int i = 0; i < 8; i++) {
+    snprintf(hex + i * 8, 9, "%08x", sha->state[i]);
+  }
+}
+
+// Hashes a keymap as read_keymap() streams it, optionally also saving the
+// raw buffer to out.
+struct keymap_hasher {
+  struct sha256 sha;
+  FILE *out;
+};
+
+void hash_keymap_entry(uint32_t index, uint16_t keycode, void *ctx) {
+  (void)index;
+  struct keymap_hasher *hasher = ctx;
+  uint8_t bytes[] = {keycode >> 8, keycode & 0xff};
+  sha256_update(&hasher->sha, bytes, sizeof(bytes));
+  if (hasher->out != NULL && fwrite(bytes, 1, 2, hasher->out) != 2) {
+    perror("Cannot write keymap\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void print_keymap_entry(uint32_t index, uint16_t keycode, void *ctx) {
+  (void)ctx;
+  uint32_t column = index % flag_column_count;
+  uint32_t row = (index / flag_column_count) % flag_row_count;
+  uint32_t layer = index / (flag_column_count * flag_row_count);
+  printf("Layer: %02u  Row: %02u  Column: %02u  Keycode: 0x%04hx %s\n", layer,
+         row, column, keycode, keycode_name(keycode));
+}
+
 void dump_keymap() {
-  uint16_t map_size = flag_layer_count * flag_column_count * flag_row_count * 2;
+  uint32_t map_size =
+      (uint32_t)flag_layer_count * flag_column_count * flag_row_count * 2;
   if (map_size == 0) {
     fprintf(
         stderr,
         "dump_keymap requires layer (-L), column (-C), and row (-R) counts.\n");
     exit(EXIT_FAILURE);
   }
-  uint16_t offset = 0;
-  while (offset < map_size) {
-    uint16_t remaining = map_size - offset;
-    uint8_t fetch_size = (remaining > 28) ? 28 : remaining;
-    send((uint8_t[]){id_dynamic_keymap_get_buffer, offset >> 8, offset & 0xff,
-                     fetch_size},
-         4);
-    for (int i = 0; i < fetch_size; i += 2) {
-      uint16_t keycode = (packet[4 + i] << 8) | packet[5 + i];
-      uint16_t index = (offset + i) / 2;
-      uint16_t column = index % flag_column_count;
-      uint16_t row = (index / flag_column_count) % flag_row_count;
-      uint16_t layer = index / (flag_column_count * flag_row_count);
-      printf("Layer: %02hu  Row: %02hu  Column: %02hu  Keycode: 0x%04hx %s\n",
-             layer, row, column, keycode, keycode_name(keycode));
-    }
-    offset += fetch_size;
+  if (read_keymap(flag_layer_count, flag_row_count, flag_column_count,
+                  print_keymap_entry, NULL) != 0) {
+    exit(EXIT_FAILURE);
   }
 }
 
 void reset_keymap() {
-  send((uint8_t[]){id_dynamic_keymap_reset}, 1);
+  send_request((uint8_t[]){id_dynamic_keymap_reset}, 1);
 }
 
-void open_device(char *id) {
-  unsigned short vendor_id, product_id;
-  if (2 != sscanf(id, "%hx:%hx", &vendor_id, &product_id)) {
+// Walk the short items of a HID report descriptor and return the largest
+// input report, in bytes, or 0 if none could be found. A report's length is
+// the sum of all the Input items that share its Report ID.
+int descriptor_report_size(uint8_t *desc, int len) {
+  uint32_t report_size = 0, report_count = 0;
+  uint32_t report_bits[256] = {0};
+  uint8_t report_id = 0;
+  int i = 0;
+  while (i < len) {
+    uint8_t prefix = desc[i++];
+    if (prefix == 0xfe) {
+      // Long item: skip data size byte, tag byte and data.
+      if (i + 1 >= len) {
+        break;
+      }
+      i += 2 + desc[i];
+      continue;
+    }
+    int size = prefix & 0x03;
+    if (size == 3) {
+      size = 4;
+    }
+    if (i + size > len) {
+      break;
+    }
+    uint32_t value = 0;
+    for (int b = 0; b < size; b++) {
+      value |= (uint32_t)desc[i + b] << (8 * b);
+    }
+    i += size;
+    switch (prefix & 0xfc) {
+    case 0x74: // Report Size
+      report_size = value;
+      break;
+    case 0x94: // Report Count
+      report_count = value;
+      break;
+    case 0x84: // Report ID
+      report_id = value;
+      break;
+    case 0x80: // Input
+      report_bits[report_id] += report_size * report_count;
+      break;
+    }
+  }
+
+  uint32_t largest = 0;
+  for (int id = 0; id < 256; id++) {
+    if (report_bits[id] > largest) {
+      largest = report_bits[id];
+    }
+  }
+  return (largest + 7) / 8;
+}
+
+#define REPORT_DESCRIPTOR_SIZE 4096
+
+#ifdef __linux__
+// Read the report descriptor straight from the hidraw node, for hidapi
+// releases that cannot fetch it themselves.
+int hidraw_report_descriptor(char *path, uint8_t *desc, int size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct hidraw_report_descriptor rdesc;
+  int len = -1;
+  if (ioctl(fd, HIDIOCGRDESCSIZE, &rdesc.size) == 0 &&
+      ioctl(fd, HIDIOCGRDESC, &rdesc) == 0) {
+    len = (rdesc.size < (uint32_t)size) ? (int)rdesc.size : size;
+    memcpy(desc, rdesc.value, len);
+  }
+  close(fd);
+  return len;
+}
+#endif
+
+// Size packets to the raw HID report length advertised by the device at
+// path, falling back to the 32-byte default when it cannot be determined.
+void negotiate_packet_size(char *path) {
+  packet_size = PACKET_SIZE;
+  uint8_t desc[REPORT_DESCRIPTOR_SIZE];
+  int len = -1;
+#ifdef HID_API_VERSION
+#if HID_API_VERSION >= HID_API_MAKE_VERSION(0, 14, 0)
+  len = hid_get_report_descriptor(flag_device, desc, sizeof(desc));
+#endif
+#endif
+#ifdef __linux__
+  if (len <= 0) {
+    len = hidraw_report_descriptor(path, desc, sizeof(desc));
+  }
+#endif
+  if (len <= 0) {
+    return;
+  }
+  int size = descriptor_report_size(desc, len);
+  if (size >= PACKET_SIZE && size <= MAX_PACKET_SIZE) {
+    packet_size = size;
+  }
+}
+
+void parse_device_id(char *id, unsigned short *vendor_id,
+                     unsigned short *product_id) {
+  if (2 != sscanf(id, "%hx:%hx", vendor_id, product_id)) {
     printf("Cannot parse ID\n");
     exit(EXIT_FAILURE);
   }
+}
+
+int is_raw_interface(struct hid_device_info *device_info) {
+  return device_info->usage_page == RAW_USAGE_PAGE &&
+         device_info->usage == RAW_USAGE_ID;
+}
+
+void format_serial(struct hid_device_info *device_info, char *serial,
+                   size_t size) {
+  if (device_info->serial_number == NULL ||
+      snprintf(serial, size, "%ls", device_info->serial_number) < 0) {
+    serial[0] = 0;
+  }
+}
+
+// Open the device at path as the current device. Returns 0 on success.
+int open_device_path(char *path) {
+  flag_device = hid_open_path(path);
+  if (flag_device == NULL) {
+    return -1;
+  }
+  negotiate_packet_size(path);
+  return 0;
+}
+
+void close_device() {
+  if (flag_device != NULL) {
+    hid_close(flag_device);
+    flag_device = NULL;
+  }
+}
+
+void open_device(char *id) {
+  unsigned short vendor_id, product_id;
+  parse_device_id(id, &vendor_id, &product_id);
 
   struct hid_device_info *enumeration = hid_enumerate(0, 0);
   struct hid_device_info *device_info = enumeration;
   while (device_info != NULL) {
     if (device_info->vendor_id == vendor_id &&
         device_info->product_id == product_id &&
-        device_info->usage_page == RAW_USAGE_PAGE &&
-        device_info->usage == RAW_USAGE_ID) {
+        is_raw_interface(device_info)) {
       break;
     }
     device_info = device_info->next;
@@ -328,15 +838,819 @@ void open_device(char *id) {
     exit(EXIT_FAILURE);
   }
 
-  flag_device = hid_open_path(device_info->path);
-  if (flag_device == NULL) {
+  if (open_device_path(device_info->path) != 0) {
     perror("Cannot open device\n");
     exit(EXIT_FAILURE);
   }
 
+  format_serial(device_info, device_serial, sizeof(device_serial));
+
+  hid_free_enumeration(enumeration);
+}
+
+// Keymap store layout: raw keymap buffers live in objects/ named by their
+// content hash, and the index file maps each backup to one of them.
+#define STORE_INDEX "index"
+#define STORE_OBJECTS "objects"
+
+char *store_dir() {
+  static char dir[4096];
+  if (flag_store != NULL) {
+    return flag_store;
+  }
+  char *home = getenv("HOME");
+  snprintf(dir, sizeof(dir), "%s/.via", home ? home : ".");
+  return dir;
+}
+
+char *store_path(char *name) {
+  static char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", store_dir(), name);
+  return path;
+}
+
+void make_dir(char *path) {
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    perror("Cannot create store\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+struct store_entry {
+  char serial[64];
+  long long timestamp;
+  char hash[SHA256_HEX_SIZE];
+  unsigned layers, rows, columns;
+};
+
+// Find the most recent index entry for serial. Returns 0 if one was found.
+int find_store_entry(char *serial, struct store_entry *found) {
+  FILE *index = fopen(store_path(STORE_INDEX), "r");
+  if (index == NULL) {
+    return -1;
+  }
+  int result = -1;
+  struct store_entry entry;
+  while (fscanf(index, "%63s %lld %64s %u %u %u", entry.serial,
+                &entry.timestamp, entry.hash, &entry.layers, &entry.rows,
+                &entry.columns) == 6) {
+    if (strcmp(entry.serial, serial) == 0) {
+      *found = entry;
+      result = 0;
+    }
+  }
+  fclose(index);
+  return result;
+}
+
+// Index entries are whitespace separated, so make the serial a single word.
+char *store_serial() {
+  static char serial[sizeof(device_serial)];
+  // Boards of one model share a vendor and product ID, so without a USB
+  // serial there is nothing that tells them apart in the index.
+  if (device_serial[0] == 0) {
+    fprintf(stderr, "Device has no USB serial to index its backups by.\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(serial, device_serial);
+  for (char *c = serial; *c; c++) {
+    if (*c <= ' ') {
+      *c = '_';
+    }
+  }
+  return serial;
+}
+
+// Metrics state for one device, kept across collections so that transport
+// counters accumulate for as long as the exporter runs.
+struct device_metrics {
+  char *path;
+  char labels[256];
+  int present;
+  int up;
+  uint16_t version;
+  uint32_t uptime;
+  uint8_t layer_count;
+  int has_keymap_hash;
+  char keymap_hash[SHA256_HEX_SIZE];
+  struct transport_stats stats;
+};
+
+struct device_metrics *metrics_devices = NULL;
+size_t metrics_device_count = 0;
+
+struct device_metrics *find_device_metrics(char *path) {
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    if (strcmp(metrics_devices[i].path, path) == 0) {
+      return &metrics_devices[i];
+    }
+  }
+  metrics_devices = realloc(metrics_devices, (metrics_device_count + 1) *
+                                                 sizeof(*metrics_devices));
+  if (metrics_devices == NULL) {
+    perror("Cannot allocate metrics\n");
+    exit(EXIT_FAILURE);
+  }
+  struct device_metrics *m = &metrics_devices[metrics_device_count++];
+  memset(m, 0, sizeof(*m));
+  m->path = strdup(path);
+  return m;
+}
+
+// Format Prometheus labels identifying a device, escaping the serial.
+void format_labels(struct device_metrics *m,
+                   struct hid_device_info *device_info) {
+  char serial[64];
+  format_serial(device_info, serial, sizeof(serial));
+  char escaped[sizeof(serial) * 2];
+  char *next = escaped;
+  for (char *c = serial; *c; c++) {
+    if (*c == '\\' || *c == '"') {
+      *(next++) = '\\';
+      *(next++) = *c;
+    } else if (*c == '\n') {
+      *(next++) = '\\';
+      *(next++) = 'n';
+    } else {
+      *(next++) = *c;
+    }
+  }
+  *next = 0;
+  snprintf(m->labels, sizeof(m->labels),
+           "vendor=\"%04x\",product=\"%04x\",serial=\"%s\"",
+           device_info->vendor_id, device_info->product_id, escaped);
+}
+
+// Collect one device's metrics over a single open handle.
+void collect_device(struct device_metrics *m, char *path) {
+  m->up = 0;
+  m->has_keymap_hash = 0;
+  if (open_device_path(path) != 0) {
+    return;
+  }
+  stats = &m->stats;
+
+  if (transact((uint8_t[]){id_get_protocol_version}, 1) != 0) {
+    goto done;
+  }
+  m->version = packet[1] << 8 | packet[2];
+
+  if (transact((uint8_t[]){id_get_keyboard_value, id_uptime}, 2) != 0) {
+    goto done;
+  }
+  m->uptime = packet[2] << 24 | packet[3] << 16 | packet[4] << 8 | packet[5];
+
+  if (transact((uint8_t[]){id_dynamic_keymap_get_layer_count}, 1) != 0) {
+    goto done;
+  }
+  m->layer_count = packet[1];
+
+  // The keymap hash costs a full keymap sweep, so only take it when the
+  // dimensions are known. Boards differ, so prefer those recorded by the
+  // device's latest backup, which also makes the hash match the store's.
+  uint8_t layers = 0, rows = 0, columns = 0;
+  struct store_entry entry;
+  if (device_serial[0] != 0 &&
+      find_store_entry(store_serial(), &entry) == 0) {
+    layers = entry.layers;
+    rows = entry.rows;
+    columns = entry.columns;
+  } else if (flag_row_count != 0 && flag_column_count != 0) {
+    layers = flag_layer_count ? flag_layer_count : m->layer_count;
+    rows = flag_row_count;
+    columns = flag_column_count;
+  }
+  if (rows != 0 && columns != 0) {
+    struct keymap_hasher hasher = {.out = NULL};
+    sha256_init(&hasher.sha);
+    if (read_keymap(layers, rows, columns, hash_keymap_entry, &hasher) != 0) {
+      goto done;
+    }
+    sha256_hex(&hasher.sha, m->keymap_hash);
+    m->has_keymap_hash = 1;
+  }
+  m->up = 1;
+
+done:
+  stats = NULL;
+  close_device();
+}
+
+void collect_metrics() {
+  unsigned short vendor_id = 0, product_id = 0;
+  if (flag_device_id != NULL) {
+    parse_device_id(flag_device_id, &vendor_id, &product_id);
+  }
+
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    metrics_devices[i].present = 0;
+  }
+
+  struct hid_device_info *enumeration = hid_enumerate(vendor_id, product_id);
+  struct hid_device_info *device_info = enumeration;
+  while (device_info != NULL) {
+    if (is_raw_interface(device_info)) {
+      struct device_metrics *m = find_device_metrics(device_info->path);
+      format_labels(m, device_info);
+      format_serial(device_info, device_serial, sizeof(device_serial));
+      m->present = 1;
+      collect_device(m, device_info->path);
+    }
+    device_info = device_info->next;
+  }
   hid_free_enumeration(enumeration);
 }
 
+void metric_header(FILE *out, char *name, char *type, char *help) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void write_metrics(FILE *out) {
+  metric_header(out, "via_up", "gauge",
+                "Whether the last collection from the device succeeded.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (m->present) {
+      fprintf(out, "via_up{%s} %d\n", m->labels, m->up);
+    }
+  }
+
+  metric_header(out, "via_uptime_seconds", "gauge",
+                "Time since the keyboard firmware started.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (m->present && m->up) {
+      fprintf(out, "via_uptime_seconds{%s} %.3f\n", m->labels,
+              m->uptime / 1000.0);
+    }
+  }
+
+  metric_header(out, "via_protocol_version", "gauge",
+                "VIA protocol version reported by the firmware.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (m->present && m->up) {
+      fprintf(out, "via_protocol_version{%s} %u\n", m->labels, m->version);
+    }
+  }
+
+  metric_header(out, "via_layer_count", "gauge",
+                "Number of dynamic keymap layers.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (m->present && m->up) {
+      fprintf(out, "via_layer_count{%s} %u\n", m->labels, m->layer_count);
+    }
+  }
+
+  metric_header(out, "via_keymap_info", "gauge",
+                "SHA-256 of the raw dynamic keymap buffer, as a label.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (m->present && m->up && m->has_keymap_hash) {
+      fprintf(out, "via_keymap_info{%s,sha256=\"%s\"} 1\n", m->labels,
+              m->keymap_hash);
+    }
+  }
+
+  metric_header(out, "via_transactions_total", "counter",
+                "Completed raw HID request/response exchanges.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (m->present) {
+      fprintf(out, "via_transactions_total{%s} %llu\n", m->labels,
+              (unsigned long long)m->stats.transactions);
+    }
+  }
+
+  metric_header(out, "via_timeouts_total", "counter",
+                "Responses that did not arrive within the read timeout.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (m->present) {
+      fprintf(out, "via_timeouts_total{%s} %llu\n", m->labels,
+              (unsigned long long)m->stats.timeouts);
+    }
+  }
+
+  metric_header(out, "via_retries_total", "counter",
+                "Requests resent after a timeout.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (m->present) {
+      fprintf(out, "via_retries_total{%s} %llu\n", m->labels,
+              (unsigned long long)m->stats.retries);
+    }
+  }
+
+  metric_header(out, "via_transaction_duration_seconds", "histogram",
+                "Latency of completed transactions, including retries.");
+  for (size_t i = 0; i < metrics_device_count; i++) {
+    struct device_metrics *m = &metrics_devices[i];
+    if (!m->present) {
+      continue;
+    }
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b < LATENCY_BUCKET_COUNT; b++) {
+      cumulative += m->stats.latency_counts[b];
+      fprintf(out,
+              "via_transaction_duration_seconds_bucket{%s,le=\"%g\"} %llu\n",
+              m->labels, latency_buckets[b], (unsigned long long)cumulative);
+    }
+    cumulative += m->stats.latency_counts[LATENCY_BUCKET_COUNT];
+    fprintf(out,
+            "via_transaction_duration_seconds_bucket{%s,le=\"+Inf\"} %llu\n",
+            m->labels, (unsigned long long)cumulative);
+    fprintf(out, "via_transaction_duration_seconds_sum{%s} %f\n", m->labels,
+            m->stats.latency_sum);
+    fprintf(out, "via_transaction_duration_seconds_count{%s} %llu\n",
+            m->labels, (unsigned long long)cumulative);
+  }
+}
+
+// Write metrics to a temporary file beside path and rename it into place,
+// so that readers never see a partially written file.
+void write_metrics_file(char *path) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    perror("Cannot open metrics file\n");
+    exit(EXIT_FAILURE);
+  }
+  write_metrics(out);
+  if (fclose(out) != 0 || rename(tmp, path) != 0) {
+    perror("Cannot write metrics file\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void metrics() {
+  while (1) {
+    collect_metrics();
+    if (flag_output != NULL) {
+      write_metrics_file(flag_output);
+    } else {
+      write_metrics(stdout);
+      fflush(stdout);
+    }
+    if (flag_interval == 0) {
+      break;
+    }
+    sleep(flag_interval);
+  }
+}
+
+void backup() {
+  if (flag_row_count == 0 || flag_column_count == 0) {
+    fprintf(stderr, "backup requires column (-C) and row (-R) counts.\n");
+    exit(EXIT_FAILURE);
+  }
+  char *serial = store_serial();
+  uint8_t layers = flag_layer_count ? flag_layer_count : get_layer_count();
+
+  make_dir(store_dir());
+  make_dir(store_path(STORE_OBJECTS));
+
+  // Stream the keymap into a temporary object while hashing it, then either
+  // move it into place or drop it if that content is already stored.
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s/tmp.%d", store_path(STORE_OBJECTS),
+           (int)getpid());
+  struct keymap_hasher hasher = {.out = fopen(tmp, "wb")};
+  sha256_init(&hasher.sha);
+  if (hasher.out == NULL) {
+    perror("Cannot create object\n");
+    exit(EXIT_FAILURE);
+  }
+  if (read_keymap(layers, flag_row_count, flag_column_count,
+                  hash_keymap_entry, &hasher) != 0) {
+    fclose(hasher.out);
+    unlink(tmp);
+    exit(EXIT_FAILURE);
+  }
+  if (fclose(hasher.out) != 0) {
+    perror("Cannot write object\n");
+    unlink(tmp);
+    exit(EXIT_FAILURE);
+  }
+
+  char hash[SHA256_HEX_SIZE];
+  sha256_hex(&hasher.sha, hash);
+  char name[128];
+  snprintf(name, sizeof(name), "%s/%s", STORE_OBJECTS, hash);
+  char *object = store_path(name);
+  if (access(object, F_OK) == 0) {
+    unlink(tmp);
+    printf("Unchanged: %s\n", hash);
+  } else {
+    if (rename(tmp, object) != 0) {
+      perror("Cannot store object\n");
+      unlink(tmp);
+      exit(EXIT_FAILURE);
+    }
+    printf("Stored: %s\n", hash);
+  }
+
+  FILE *index = fopen(store_path(STORE_INDEX), "a");
+  if (index == NULL ||
+      fprintf(index, "%s %lld %s %u %u %u\n", serial,
+              (long long)time(NULL), hash, layers, flag_row_count,
+              flag_column_count) < 0 ||
+      fclose(index) != 0) {
+    perror("Cannot update index\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void status() {
+  struct store_entry entry;
+  if (find_store_entry(store_serial(), &entry) != 0) {
+    fprintf(stderr, "No backup for %s\n", device_serial);
+    exit(EXIT_FAILURE);
+  }
+
+  struct keymap_hasher hasher = {.out = NULL};
+  sha256_init(&hasher.sha);
+  if (read_keymap(entry.layers, entry.rows, entry.columns, hash_keymap_entry,
+                  &hasher) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  char hash[SHA256_HEX_SIZE];
+  sha256_hex(&hasher.sha, hash);
+  printf("Expected: %s\n", entry.hash);
+  printf("Actual: %s\n", hash);
+  if (strcmp(hash, entry.hash) != 0) {
+    printf("Status: modified\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("Status: unchanged\n");
+}
+
+#define MAX_DAEMON_CLIENTS 64
+
+struct daemon_client {
+  int fd;
+  uint8_t request[MAX_PACKET_SIZE + 1];
+  int received;
+  int queued;
+  double queued_at;
+};
+
+struct daemon_stats {
+  uint64_t queue_depth;
+  uint64_t max_queue_depth;
+  uint64_t requests;
+  uint64_t transactions;
+  uint64_t coalesced;
+  uint64_t wait_us_total;
+  uint64_t wait_us_max;
+};
+
+#define DAEMON_STATS_FIELDS (sizeof(struct daemon_stats) / sizeof(uint64_t))
+
+struct daemon_client daemon_clients[MAX_DAEMON_CLIENTS];
+// Clients with a complete request waiting, in arrival order. Each client
+// has at most one request queued, so every client gets a turn per round.
+int daemon_queue[MAX_DAEMON_CLIENTS];
+int daemon_queue_len = 0;
+struct daemon_stats daemon_stats;
+
+char *socket_path() {
+  static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  if (flag_socket != NULL) {
+    return flag_socket;
+  }
+  char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir != NULL) {
+    snprintf(path, sizeof(path), "%s/via.sock", runtime_dir);
+  } else {
+    snprintf(path, sizeof(path), "/tmp/via-%d.sock", (int)getuid());
+  }
+  return path;
+}
+
+int socket_address(struct sockaddr_un *addr) {
+  char *path = socket_path();
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+void connect_daemon() {
+  struct sockaddr_un addr;
+  if (socket_address(&addr) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  daemon_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (daemon_fd < 0 ||
+      connect(daemon_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("Cannot connect to daemon\n");
+    exit(EXIT_FAILURE);
+  }
+  uint8_t size[2];
+  if (read_full(daemon_fd, size, sizeof(size)) != 0) {
+    fprintf(stderr, "Lost connection to daemon\n");
+    exit(EXIT_FAILURE);
+  }
+  packet_size = size[0] << 8 | size[1];
+  if (packet_size < PACKET_SIZE || packet_size > MAX_PACKET_SIZE) {
+    fprintf(stderr, "Daemon reported bad packet size: %d\n", packet_size);
+    exit(EXIT_FAILURE);
+  }
+  uint8_t serial_len;
+  if (read_full(daemon_fd, &serial_len, 1) != 0 ||
+      serial_len >= sizeof(device_serial) ||
+      read_full(daemon_fd, (uint8_t *)device_serial, serial_len) != 0) {
+    fprintf(stderr, "Lost connection to daemon\n");
+    exit(EXIT_FAILURE);
+  }
+  device_serial[serial_len] = 0;
+}
+
+void close_client(struct daemon_client *client) {
+  close(client->fd);
+  client->fd = -1;
+  if (client->queued) {
+    int index = client - daemon_clients;
+    for (int i = 0; i < daemon_queue_len; i++) {
+      if (daemon_queue[i] == index) {
+        memmove(&daemon_queue[i], &daemon_queue[i + 1],
+                (daemon_queue_len - i - 1) * sizeof(daemon_queue[0]));
+        daemon_queue_len--;
+        break;
+      }
+    }
+    client->queued = 0;
+    daemon_stats.queue_depth = daemon_queue_len;
+  }
+}
+
+void respond(struct daemon_client *client, uint8_t status, uint8_t *data,
+             int len) {
+  uint8_t response[DAEMON_HEADER_SIZE + MAX_PACKET_SIZE];
+  response[0] = status;
+  response[1] = len >> 8;
+  response[2] = len & 0xff;
+  memcpy(response + DAEMON_HEADER_SIZE, data, len);
+  client->received = 0;
+  // Fails rather than blocks if the client is not reading its responses.
+  if (write_full(client->fd, response, DAEMON_HEADER_SIZE + len) != 0) {
+    close_client(client);
+  }
+}
+
+void respond_stats(struct daemon_client *client) {
+  uint64_t *fields = (uint64_t *)&daemon_stats;
+  uint8_t data[DAEMON_STATS_FIELDS * 8];
+  for (size_t i = 0; i < DAEMON_STATS_FIELDS; i++) {
+    for (int b = 0; b < 8; b++) {
+      data[i * 8 + b] = fields[i] >> (56 - 8 * b);
+    }
+  }
+  respond(client, DAEMON_OK, data, sizeof(data));
+}
+
+void record_wait(struct daemon_client *client) {
+  uint64_t wait_us = (monotonic_seconds() - client->queued_at) * 1e6;
+  daemon_stats.wait_us_total += wait_us;
+  if (wait_us > daemon_stats.wait_us_max) {
+    daemon_stats.wait_us_max = wait_us;
+  }
+}
+
+// Run the request at the head of the queue against the device, answering
+// every other queued client that asked for the same read with its result.
+// Reads queued after a write must see that write, so sharing stops at the
+// first write behind the head.
+void serve_next_request() {
+  struct daemon_client *head = &daemon_clients[daemon_queue[0]];
+  uint8_t *request = head->request + 1;
+  int len = head->request[0];
+  int ok = transact(request, len) == 0;
+  daemon_stats.transactions++;
+
+  int coalesce = ok && is_read_request(request, len);
+  int remaining = 0;
+  for (int i = 0; i < daemon_queue_len; i++) {
+    struct daemon_client *client = &daemon_clients[daemon_queue[i]];
+    int same = client == head ||
+               (coalesce && client->request[0] == len &&
+                memcmp(client->request + 1, request, len) == 0);
+    if (!same) {
+      if (!is_read_request(client->request + 1, client->request[0])) {
+        coalesce = 0;
+      }
+      daemon_queue[remaining++] = daemon_queue[i];
+      continue;
+    }
+    if (client != head) {
+      daemon_stats.coalesced++;
+    }
+    client->queued = 0;
+    record_wait(client);
+    respond(client, ok ? DAEMON_OK : DAEMON_ERROR, packet, packet_size);
+  }
+  daemon_queue_len = remaining;
+  daemon_stats.queue_depth = daemon_queue_len;
+}
+
+// Read as much of a request as is available, queueing it once complete.
+// The length byte and body usually arrive together, so keep reading until
+// the request is whole or the socket is drained.
+void read_client(struct daemon_client *client) {
+  do {
+    int wanted = (client->received == 0)
+                     ? 1
+                     : 1 + client->request[0] - client->received;
+    ssize_t n = read(client->fd, client->request + client->received, wanted);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n <= 0) {
+      close_client(client);
+      return;
+    }
+    client->received += n;
+  } while (client->received != 1 + client->request[0]);
+
+  daemon_stats.requests++;
+  if (client->request[0] == 0) {
+    respond_stats(client);
+  } else if (client->request[0] > packet_size - 1) {
+    respond(client, DAEMON_ERROR, NULL, 0);
+  } else {
+    client->queued = 1;
+    client->queued_at = monotonic_seconds();
+    daemon_queue[daemon_queue_len++] = client - daemon_clients;
+    daemon_stats.queue_depth = daemon_queue_len;
+    if (daemon_stats.queue_depth > daemon_stats.max_queue_depth) {
+      daemon_stats.max_queue_depth = daemon_stats.queue_depth;
+    }
+  }
+}
+
+void accept_client(int listener) {
+  int fd = accept(listener, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+  // The daemon never waits on one client: a client that stops reading its
+  // responses is dropped once its socket buffer fills.
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  for (int i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+    struct daemon_client *client = &daemon_clients[i];
+    if (client->fd < 0) {
+      memset(client, 0, sizeof(*client));
+      client->fd = fd;
+      uint8_t hello[3 + sizeof(device_serial)];
+      int serial_len = strlen(device_serial);
+      hello[0] = packet_size >> 8;
+      hello[1] = packet_size & 0xff;
+      hello[2] = serial_len;
+      memcpy(hello + 3, device_serial, serial_len);
+      if (write_full(fd, hello, 3 + serial_len) != 0) {
+        close_client(client);
+      }
+      return;
+    }
+  }
+  close(fd);
+}
+
+// Remove a socket left behind by a daemon that has exited. Anything else at
+// path, including the socket of a daemon that is still running, is an error.
+int remove_stale_socket(struct sockaddr_un *addr) {
+  struct stat st;
+  if (lstat(addr->sun_path, &st) != 0) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "Not a socket: %s\n", addr->sun_path);
+    return -1;
+  }
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe < 0) {
+    return -1;
+  }
+  int live = connect(probe, (struct sockaddr *)addr, sizeof(*addr)) == 0 ||
+             errno != ECONNREFUSED;
+  close(probe);
+  if (live) {
+    fprintf(stderr, "Socket in use: %s\n", addr->sun_path);
+    return -1;
+  }
+  return unlink(addr->sun_path);
+}
+
+void daemon_main() {
+  if (flag_device == NULL) {
+    fprintf(stderr, "--device flag required.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct sockaddr_un addr;
+  if (socket_address(&addr) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  if (remove_stale_socket(&addr) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listener, MAX_DAEMON_CLIENTS) != 0) {
+    perror("Cannot listen on socket\n");
+    exit(EXIT_FAILURE);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+    daemon_clients[i].fd = -1;
+  }
+
+  struct pollfd fds[MAX_DAEMON_CLIENTS + 1];
+  while (1) {
+    // Only listen to clients without a queued request, and don't block
+    // while there is device work waiting.
+    int nfds = 0;
+    fds[nfds++] = (struct pollfd){listener, POLLIN, 0};
+    for (int i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+      if (daemon_clients[i].fd >= 0) {
+        fds[nfds++] = (struct pollfd){daemon_clients[i].fd,
+                                      daemon_clients[i].queued ? 0 : POLLIN, 0};
+      }
+    }
+    if (poll(fds, nfds, daemon_queue_len > 0 ? 0 : -1) < 0 && errno != EINTR) {
+      perror("poll failed\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int f = 1; f < nfds; f++) {
+      if (fds[f].revents == 0) {
+        continue;
+      }
+      for (int i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+        struct daemon_client *client = &daemon_clients[i];
+        if (client->fd != fds[f].fd) {
+          continue;
+        }
+        if (fds[f].revents & POLLIN) {
+          read_client(client);
+        } else {
+          close_client(client);
+        }
+        break;
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      accept_client(listener);
+    }
+
+    if (daemon_queue_len > 0) {
+      serve_next_request();
+    }
+  }
+}
+
+void daemon_stats_command() {
+  flag_socket = socket_path();
+  connect_daemon();
+  uint8_t request = 0;
+  uint8_t header[DAEMON_HEADER_SIZE];
+  uint8_t data[DAEMON_STATS_FIELDS * 8];
+  if (write_full(daemon_fd, &request, 1) != 0 ||
+      read_full(daemon_fd, header, sizeof(header)) != 0 ||
+      (header[1] << 8 | header[2]) != sizeof(data) ||
+      read_full(daemon_fd, data, sizeof(data)) != 0) {
+    fprintf(stderr, "Lost connection to daemon\n");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t fields[DAEMON_STATS_FIELDS] = {0};
+  for (size_t i = 0; i < DAEMON_STATS_FIELDS; i++) {
+    for (int b = 0; b < 8; b++) {
+      fields[i] = fields[i] << 8 | data[i * 8 + b];
+    }
+  }
+  struct daemon_stats *s = (struct daemon_stats *)fields;
+  printf("Queue depth: %" PRIu64 "\n", s->queue_depth);
+  printf("Max queue depth: %" PRIu64 "\n", s->max_queue_depth);
+  printf("Requests: %" PRIu64 "\n", s->requests);
+  printf("Transactions: %" PRIu64 "\n", s->transactions);
+  printf("Coalesced: %" PRIu64 "\n", s->coalesced);
+  printf("Mean wait: %" PRIu64 "us\n",
+         s->transactions + s->coalesced
+             ? s->wait_us_total / (s->transactions + s->coalesced)
+             : 0);
+  printf("Max wait: %" PRIu64 "us\n", s->wait_us_max);
+}
+
 void u8(char *arg, uint8_t *dest, char *name) {
   if (sscanf(arg, "%hhu", dest) != 1) {
     fprintf(stderr, "Invalid %s: %s\n", name, arg);
@@ -351,10 +1665,18 @@ void x16(char *arg, unsigned short *dest, char *name) {
   }
 }
 
+void u16(char *arg, unsigned short *dest, char *name) {
+  if (sscanf(arg, "%hu", dest) != 1) {
+    fprintf(stderr, "Invalid %s: %s\n", name, arg);
+    exit(EXIT_FAILURE);
+  }
+}
+
 void cleanup() {
-  if (flag_device != NULL) {
-    hid_close(flag_device);
+  if (daemon_fd >= 0) {
+    close(daemon_fd);
   }
+  close_device();
   hid_exit();
 }
 
@@ -368,7 +1690,8 @@ int main(int argc, char **argv) {
   char *cmd = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "-d:m:s:b:h:S:r:c:l:k:L:R:C:")) != -1) {
+  while ((opt = getopt(argc, argv, "-d:m:s:b:h:S:r:c:l:k:L:R:C:i:o:D:U:")) !=
+         -1) {
     switch (opt) {
     case 1:
       if (cmd != NULL) {
@@ -378,7 +1701,7 @@ int main(int argc, char **argv) {
       cmd = optarg;
       break;
     case 'd':
-      open_device(optarg);
+      flag_device_id = optarg;
       break;
     case 'm':
       u8(optarg, &flag_mode, "mode");
@@ -416,12 +1739,38 @@ int main(int argc, char **argv) {
     case 'C':
       u8(optarg, &flag_column_count, "column count");
       break;
+    case 'i':
+      u16(optarg, &flag_interval, "interval");
+      break;
+    case 'o':
+      flag_output = optarg;
+      break;
+    case 'D':
+      flag_store = optarg;
+      break;
+    case 'U':
+      flag_socket = optarg;
+      break;
     default:
       help();
       exit(EXIT_FAILURE);
     }
   }
 
+  // The metrics exporter opens each device itself, once per collection,
+  // and the daemon owns the socket rather than connecting to it.
+  if (flag_socket != NULL && cmd != NULL && strcmp(cmd, "metrics") == 0) {
+    fprintf(stderr, "metrics cannot be collected through a daemon (-U).\n");
+    exit(EXIT_FAILURE);
+  }
+  int own_device = cmd != NULL && strcmp(cmd, "metrics") != 0 &&
+                   strcmp(cmd, "daemon_stats") != 0;
+  if (flag_socket != NULL && own_device && strcmp(cmd, "daemon") != 0) {
+    connect_daemon();
+  } else if (flag_device_id != NULL && own_device) {
+    open_device(flag_device_id);
+  }
+
   if (cmd == NULL || strcmp(cmd, "help") == 0) {
     help();
   } else if (strcmp(cmd, "devices") == 0) {
@@ -456,6 +1805,16 @@ int main(int argc, char **argv) {
     dump_keymap();
   } else if (strcmp(cmd, "reset_keymap") == 0) {
     reset_keymap();
+  } else if (strcmp(cmd, "metrics") == 0) {
+    metrics();
+  } else if (strcmp(cmd, "backup") == 0) {
+    backup();
+  } else if (strcmp(cmd, "status") == 0) {
+    status();
+  } else if (strcmp(cmd, "daemon") == 0) {
+    daemon_main();
+  } else if (strcmp(cmd, "daemon_stats") == 0) {
+    daemon_stats_command();
   } else {
     help();
   }